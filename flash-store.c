@@ -0,0 +1,170 @@
+/*
+ * This file is part of the lasc MIDI swich project.
+ *
+ * Copyright (C) 2021 Simon Greaves (simon@panicpants.com).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+ 
+/* 
+   This module contains the lasc bulk data store in program flash.
+
+   The lasc needs:
+    - init routine, get the block programming code into RAM
+    - find a table, returning a pointer straight into flash
+    - write a 64 byte block
+
+   The stm8s can't read program flash while a block of it is being
+   programmed so the few instructions which do that are copied to RAM
+   and run from there with interrupts disabled. A standard block program
+   (erase then write) takes about 6ms and the 1ms ticks in that time are
+   lost, not delayed, since only one pending timer update is serviced
+   afterwards, so the millisecond count falls about 5ms behind for each
+   block written.
+*/
+
+#include "stm8s.h"
+#include "flash-store.h"
+
+static void fstoreProgram(void);
+static void fstoreProgramEnd(void);
+
+/*---------------------------------------------------------------------------*/
+
+/* Block programming code copied from flash, and its arguments */
+static uint8_t fstoreRamCode[FSTORE_RAMCODE_MAX];
+static uint8_t fstoreRamCodeOk = 0;
+static uint8_t fstoreBuf[FSTORE_BLOCK_SIZE];
+static uint16_t fstoreDst;
+
+/* Copy the block programming code into RAM. Returns FSTORE_OK or
+   FSTORE_ERR_RAMCODE, in which case blocks can't be written. */
+uint8_t fstore_Init(void)
+{
+    uint8_t i;
+    uint8_t *src = (uint8_t *)(uint16_t)fstoreProgram;
+    uint16_t len = (uint16_t)fstoreProgramEnd - (uint16_t)fstoreProgram;
+
+    if (len > FSTORE_RAMCODE_MAX)
+        return FSTORE_ERR_RAMCODE;
+
+    for (i = 0; i < len; i++)
+        fstoreRamCode[i] = src[i];
+    fstoreRamCodeOk = 1;
+    return FSTORE_OK;
+}
+
+/* Find a table in the store. Returns a pointer to it in flash and sets
+   'len' to its length or returns NULL if it isn't there. */
+const uint8_t *fstore_Table(uint8_t id, uint16_t *len)
+{
+    const uint8_t *dir = (const uint8_t *)FSTORE_START;
+    const uint8_t *ent;
+    uint8_t i, n;
+    uint16_t offset, length;
+
+    if (dir[0] != FSTORE_MAGIC0 || dir[1] != FSTORE_MAGIC1)
+        return NULL;
+
+    n = dir[2];
+    if (n > FSTORE_DIR_MAX)
+        n = FSTORE_DIR_MAX;
+
+    for (i = 0, ent = &dir[3]; i < n; i++, ent += FSTORE_DIR_ENTRY_LEN)
+        {
+            if (ent[0] != id)
+                continue;
+
+            offset = ((uint16_t)ent[1] << 8) | ent[2];
+            length = ((uint16_t)ent[3] << 8) | ent[4];
+            if (offset < FSTORE_BLOCK_SIZE || offset > FSTORE_SIZE || length > FSTORE_SIZE - offset)
+                return NULL;
+
+            *len = length;
+            return dir + offset;
+        }
+    return NULL;
+}
+
+/* Program a 64 byte block of the store, block 0 is the directory.
+   Returns FSTORE_OK if the block was written and reads back correctly,
+   otherwise one of the FSTORE_ERR_ codes. */
+uint8_t fstore_WriteBlock(uint8_t block, const uint8_t *data)
+{
+    uint8_t i;
+    const uint8_t *chk;
+
+    if (block >= FSTORE_BLOCKS)
+        return FSTORE_ERR_BLOCK;
+    if (! fstoreRamCodeOk)
+        return FSTORE_ERR_RAMCODE;
+
+    for (i = 0; i < FSTORE_BLOCK_SIZE; i++)
+        fstoreBuf[i] = data[i];
+    fstoreDst = FSTORE_START + (block * FSTORE_BLOCK_SIZE);
+
+    /* Unlock program memory */
+    FLASH_SetProgrammingTime(FLASH_PROGRAMTIME_STANDARD);
+    FLASH_Unlock(FLASH_MEMTYPE_PROG);
+    while (FLASH_GetFlagStatus(FLASH_FLAG_PUL) == RESET);
+
+    /* Nothing may run from flash until the block is done */
+    disableInterrupts();
+    ((void (*)(void))fstoreRamCode)();
+    enableInterrupts();
+
+    FLASH_Lock(FLASH_MEMTYPE_PROG);
+
+    /* Read back and verify */
+    chk = (const uint8_t *)fstoreDst;
+    for (i = 0; i < FSTORE_BLOCK_SIZE; i++)
+        if (chk[i] != data[i])
+            return FSTORE_ERR_VERIFY;
+    return FSTORE_OK;
+}
+
+/*-------------------------------------------------*/
+
+/* Standard (erase and write) block program of fstoreBuf to fstoreDst.
+   NB this is never called where it is, it is copied to RAM by
+   fstore_Init() so must only use relative jumps and no calls. */
+static void fstoreProgram(void) __naked
+{
+    __asm
+    mov     0x505b, #0x01        ; FLASH_CR2  = PRG
+    mov     0x505c, #0xfe        ; FLASH_NCR2 = ~PRG
+    ldw     x, _fstoreDst
+    clrw    y
+00001$:
+    ld      a, (_fstoreBuf, y)
+    ld      (x), a
+    incw    x
+    incw    y
+    cpw     y, #64
+    jrne    00001$
+00002$:
+    ld      a, 0x505f            ; FLASH_IAPSR
+    and     a, #0x05             ; EOP or WR_PG_DIS
+    jreq    00002$
+    ret
+    __endasm;
+}
+
+/* Marks the end of fstoreProgram() so its size is known */
+static void fstoreProgramEnd(void) __naked
+{
+    __asm
+    ret
+    __endasm;
+}
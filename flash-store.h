@@ -0,0 +1,75 @@
+/*
+ * This file is part of the lasc MIDI swich project.
+ *
+ * Copyright (C) 2021 Simon Greaves (simon@panicpants.com).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+ 
+/*
+  flash-store
+
+  Read-mostly bulk tables kept in a reserved region at the top of program
+  flash. The region is written a 64 byte block at a time and read in place
+  through ordinary pointers, the data EEPROM is left for small, frequently
+  changing state.
+
+  Block 0 is a directory: FSTORE_MAGIC0, FSTORE_MAGIC1, the number of
+  tables and then 5 bytes per table - table ID, offset of the table from
+  the start of the region (2 bytes) and its length (2 bytes). Multi-byte
+  values, here and in the tables, are big-endian like the stm8.
+
+  NB the program itself must end below FSTORE_START, the Makefile checks
+  the linked .ihx and fails the build if it doesn't.
+*/
+
+#ifndef __FLASH_STORE_H_
+#define __FLASH_STORE_H_
+
+/* Size and position of the region. NB if FSTORE_BLOCKS is changed
+   FSTORE_START in the Makefile must be changed to match. */
+#define FSTORE_BLOCK_SIZE        FLASH_BLOCK_SIZE
+#define FSTORE_BLOCKS            8
+#define FSTORE_SIZE              (FSTORE_BLOCKS * FSTORE_BLOCK_SIZE)
+#define FSTORE_START             (FLASH_PROG_END_PHYSICAL_ADDRESS + 1 - FSTORE_SIZE)
+
+/* Directory */
+#define FSTORE_MAGIC0            'L'
+#define FSTORE_MAGIC1            'S'
+#define FSTORE_DIR_ENTRY_LEN     5
+#define FSTORE_DIR_MAX           ((FSTORE_BLOCK_SIZE - 3) / FSTORE_DIR_ENTRY_LEN)
+
+/* Table IDs */
+#define FSTORE_TABLE_SCENES      0x01
+
+/* Room for the code copied to RAM to program a block. NB that code
+   assumes 64 byte blocks. */
+#define FSTORE_RAMCODE_MAX       48
+
+/* Results of fstore_Init() and fstore_WriteBlock() */
+#define FSTORE_OK                0
+#define FSTORE_ERR_BLOCK         1    /* no such block */
+#define FSTORE_ERR_RAMCODE       2    /* programming code too big for RAM */
+#define FSTORE_ERR_VERIFY        3    /* block didn't read back correctly */
+
+#ifndef NULL
+#define NULL                     (void *)0
+#endif /* NULL */
+
+/* Public exported functions */
+uint8_t fstore_Init(void);
+const uint8_t *fstore_Table(uint8_t id, uint16_t *len);
+uint8_t fstore_WriteBlock(uint8_t block, const uint8_t *data);
+
+#endif /* __FLASH_STORE_H_ */
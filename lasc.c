@@ -65,19 +65,50 @@
 #error "Error! either MAX7219SPI or SSD1306I2C must be defined!"
 #endif /* defined MAX7219SPI */
 
+#ifdef FLASH_STORE
+#include "flash-store.h"
+#endif /* FLASH_STORE */
+
 static void initClk(void);
 static void initTim2(void);
 static void initGpio(void);
 static void initUart(void);
+#ifdef AUTO_BRIGHTNESS
+static void initAdc(void);
+#endif /* AUTO_BRIGHTNESS */
+static void midiTxByte(uint8_t b);
+#ifdef MIDI_THRU
+static void midiTxBegin(void);
+static void midiTxEnd(void);
+#else
+#define midiTxBegin()
+#define midiTxEnd()
+#endif /* MIDI_THRU */
+static void txMidiPC(uint8_t channel, uint16_t patch);
 static void sendMidiPC(uint16_t patch);
 static void unlockEeprom(void);
 static void lockEeprom(void);
 static uint8_t writeEepromByte(uint32_t addr, uint8_t val);
 static uint8_t readEepromByte(uint32_t addr);
+static void loadConfig(void);
 static void manageConfig(void);
+#ifdef BOOT_RESYNC
+static void resyncRig(void);
+#endif /* BOOT_RESYNC */
 static void configMIDI(void);
 static void configDisplay(void);
 static void mode2(void);
+static uint16_t stepPatch(uint16_t patch, int8_t delta);
+static void patchChange(uint16_t patch);
+static void displayPatch(uint16_t patchNo);
+static void displayNumber(uint16_t number);
+#if defined HAS_DIAGNOSTICS || defined HAS_FSTORE_LOADER
+static void displayDiag(uint8_t idx, uint8_t val);
+#endif /* defined HAS_DIAGNOSTICS || defined HAS_FSTORE_LOADER */
+#ifdef HAS_DIAGNOSTICS
+static uint8_t modeHeld(uint16_t ms);
+static void diagnostics(void);
+#endif /* HAS_DIAGNOSTICS */
 static uint8_t scanFS(uint8_t autoRepeat, uint16_t timeoutMs);
 
 /* Footswitch config. */
@@ -118,6 +149,335 @@ static __IO uint16_t flashTicks = 0;
 static __IO uint8_t doFlash = 0;
 static __IO uint8_t displayIntensity = MAX_DISPLAY_INTENSITY;
 
+#ifdef AUTO_BRIGHTNESS
+/* Ambient light level to display intensity mapping, see lasc.h */
+static uint16_t ambientThreshold[AMBIENT_STEPS - 1] = { AMBIENT_THRESHOLD_0, AMBIENT_THRESHOLD_1, AMBIENT_THRESHOLD_2 };
+static uint8_t ambientIntensity[AMBIENT_STEPS] = AMBIENT_INTENSITY;
+static uint8_t ambientIntensityDim[AMBIENT_STEPS] = AMBIENT_INTENSITY_DIM;
+
+/* ambientAcc is the filtered ADC reading scaled up by 2^AMBIENT_FILTER_SHIFT,
+   ambientStep is the resulting brightness step set by the TIM2 interrupt and
+   shownStep is the step last written to the display. */
+static __IO uint16_t ambientTicks = AMBIENT_SAMPLE_MS;
+static __IO uint16_t ambientAcc = 0;
+static __IO uint8_t ambientStep = 0;
+static uint8_t shownStep = 0xFF;
+#endif /* AUTO_BRIGHTNESS */
+
+#ifdef LATENCY_PROBE
+/* probeSent is the time the last probe finished transmitting, probeWaiting is
+   set while replies are expected. The UART receive interrupt stores the latency
+   of the first reply from each device in probeLatency[] and flags the device in
+   probeSeen. probeHist[] is the histogram for the last burst, probeDevices
+   flags those devices which appear in it. A device is its MIDI channel for
+   PC echoes, for identity replies probeId[] maps each device ID seen in
+   the burst to a device number. probeRxRunning is the running status of
+   the incoming stream and probeRxPcData is set while the program number
+   of a PC sent with its status byte is still to come. */
+static __IO uint32_t probeSent = 0;
+static __IO uint8_t probeWaiting = 0;
+#ifdef LATENCY_PROBE_IDREQ
+static __IO uint8_t probeRxState = 0;
+static __IO uint8_t probeRxId = 0;
+static __IO uint32_t probeRxTime = 0;
+static __IO uint8_t probeId[LATENCY_DEVICES];
+static __IO uint8_t probeIds = 0;
+#else
+static __IO uint8_t probeRxRunning = 0;
+static __IO uint8_t probeRxPcData = 0;
+#endif /* LATENCY_PROBE_IDREQ */
+static __IO uint16_t probeSeen = 0;
+static __IO uint16_t probeLatency[LATENCY_DEVICES];
+static uint8_t probeHist[LATENCY_DEVICES][LATENCY_BINS];
+static uint16_t probeDevices = 0;
+#endif /* LATENCY_PROBE */
+
+#ifdef PRESS_COALESCE
+/* While a PC is being sent and for COALESCE_WINDOW_MS after the last
+   press the TIM2 interrupt watches the UP and DOWN switches and adds up
+   the presses in coalesceDelta, only the final patch is then sent.
+   coalesceDown and coalesceCount are its own switch state and debounce
+   count. */
+static __IO uint8_t coalesceArmed = 0;
+static __IO int8_t coalesceDelta = 0;
+static __IO uint8_t coalesceDown[2];
+static __IO uint8_t coalesceCount[2];
+#endif /* PRESS_COALESCE */
+
+#ifdef HAS_FSTORE_LOADER
+/* Flash store block being received by sysex. fstoreRxPos counts the bytes
+   of the message so far (0 when not in one), fstoreRxReady is set when a
+   whole block has arrived and is waiting to be programmed. fstoreShown is
+   set while the result of the last block is on the display. */
+static uint8_t fstoreRxBuf[FSTORE_BLOCK_SIZE];
+static __IO uint8_t fstoreRxBlock = 0;
+static __IO uint8_t fstoreRxPos = 0;
+static __IO uint8_t fstoreRxReady = 0;
+static uint8_t fstoreShown = 0;
+static uint32_t fstoreShowTime = 0;
+#endif /* HAS_FSTORE_LOADER */
+
+#ifdef HOLD_TO_SCROLL
+/* Set by scanFS() when the switch returned is autorepeating, scrolling is
+   set by main() while the display shows a patch not yet sent */
+static uint8_t fsRepeat = 0;
+static uint8_t scrolling = 0;
+#endif /* HOLD_TO_SCROLL */
+
+#ifdef CC_RAMP
+/* Scene actions and the ramps they start, see lasc.h. ccRampTokens[] is the
+   bandwidth budget left for each MIDI channel. */
+#ifdef CC_RAMP_SCENES
+static const ccRampScene_TypeDef ccRampScenes[] = CC_RAMP_SCENES;
+#endif /* CC_RAMP_SCENES */
+static ccRamp_TypeDef ccRamps[CC_RAMP_SLOTS];
+static __IO uint8_t ccRampTokens[16];
+static __IO uint8_t ccRampTicks = CC_RAMP_STEP_MS;
+#endif /* CC_RAMP */
+
+#ifdef CPU_LOAD
+/* CPU load accounting. cpuIsrUs[] is the time spent in each interrupt
+   handler this second and cpuIsrTotal a free running total of all of
+   them, cpuIdleUs is the time spent waiting for an interrupt this second.
+   Once a second the TIM2 interrupt copies these to cpuLastIsrUs[] and
+   cpuLastIdleUs and keeps the least idle time for the peak, the
+   percentages are only worked out by cpuLoad() when they are shown so
+   the interrupt handler never has to divide. */
+static __IO uint32_t cpuIsrUs[CPU_LOAD_ISRS];
+static __IO uint32_t cpuIsrTotal = 0;
+static __IO uint32_t cpuIdleUs = 0;
+static __IO uint16_t cpuTicks = 1000;
+static __IO uint8_t cpuPeakTicks = CPU_LOAD_PEAK_S;
+static __IO uint32_t cpuLastIsrUs[CPU_LOAD_ISRS];
+static __IO uint32_t cpuLastIdleUs = CPU_LOAD_SECOND_US;
+static __IO uint32_t cpuPeakIdleRun = CPU_LOAD_SECOND_US;
+static __IO uint32_t cpuPeakIdleLast = CPU_LOAD_SECOND_US;
+
+/* Note the TIM2 count on entry to an interrupt handler, add the time
+   spent in it on exit */
+#define CPU_ISR_ENTER()       uint16_t cpuEntry = TIM2_GetCounter()
+#define CPU_ISR_EXIT(n)       cpuIsrDone((n) - CPU_LOAD_TIM2, cpuEntry)
+#define CPU_IDLE()            cpuIdle()
+#else
+#define CPU_ISR_ENTER()
+#define CPU_ISR_EXIT(n)
+#define CPU_IDLE()
+#endif /* CPU_LOAD */
+
+#ifdef MIDI_THRU
+/* MIDI thru state. Incoming bytes are written straight to the UART when
+   it is free, otherwise they go in thruBuf[] which is emptied by the
+   transmit interrupt. thruRemaining and thruInSysex track where the
+   incoming stream is so a local message is only ever merged between
+   messages. thruHold is set while a local message is waiting to go,
+   thruHeld once the incoming stream has reached a message boundary and
+   is being buffered; thruMark is the end of the data buffered before
+   that point. thruStatusLost means a local message has been sent so
+   running status must be restored before forwarding more data.
+   thruStallTicks is reloaded for each received byte and counted down by
+   the TIM2 interrupt, it reaching 0 means the input has gone quiet.
+   Setting thruMute stops forwarding at the next message boundary, thruMuted
+   follows it there so a message is never cut in two. */
+static uint8_t thruBuf[THRU_BUFFER_SIZE];
+static __IO uint8_t thruHead = 0;
+static __IO uint8_t thruTail = 0;
+static __IO uint8_t thruMark = 0;
+static __IO uint8_t thruRunning = 0;
+static __IO uint8_t thruRemaining = 0;
+static __IO uint8_t thruInSysex = 0;
+static __IO uint8_t thruHold = 0;
+static __IO uint8_t thruHeld = 0;
+static __IO uint8_t thruStatusLost = 0;
+static __IO uint8_t thruStallTicks = 0;
+static __IO uint8_t thruMute = 0;
+static __IO uint8_t thruMuted = 0;
+#endif /* MIDI_THRU */
+
+#ifdef CPU_LOAD
+/* Add the time since 'entry' to an interrupt handler's total */
+static void cpuIsrDone(uint8_t isr, uint16_t entry)
+{
+    uint16_t t = TIM2_GetCounter();
+
+    if (t < entry)
+        t += TIM2_PERIOD + 1;
+    t -= entry;
+
+    cpuIsrUs[isr] += t;
+    cpuIsrTotal += t;
+}
+
+/* Once a second, latch the times for cpuLoad() and start counting again.
+   Called from the TIM2 interrupt so just copies, no arithmetic. */
+static void cpuLatch(void)
+{
+    uint8_t i;
+
+    cpuLastIdleUs = cpuIdleUs;
+    cpuIdleUs = 0;
+
+    for (i = 0; i < CPU_LOAD_ISRS; i++)
+        {
+            cpuLastIsrUs[i] = cpuIsrUs[i];
+            cpuIsrUs[i] = 0;
+        }
+
+    /* The peak load is the least idle time, kept for this window so far
+       and the whole of the last one so a burst is seen straight away and
+       for at least CPU_LOAD_PEAK_S */
+    if (cpuLastIdleUs < cpuPeakIdleRun)
+        cpuPeakIdleRun = cpuLastIdleUs;
+    if (--cpuPeakTicks == 0)
+        {
+            cpuPeakIdleLast = cpuPeakIdleRun;
+            cpuPeakIdleRun = CPU_LOAD_SECOND_US;
+            cpuPeakTicks = CPU_LOAD_PEAK_S;
+        }
+}
+
+/* Percentage of a second */
+#define CPU_LOAD_PERCENT(us)  (uint8_t)(((us) < CPU_LOAD_SECOND_US ? (us) : CPU_LOAD_SECOND_US) / (CPU_LOAD_SECOND_US / 100))
+
+/* Work out one of the load figures, see lasc.h, from the times latched by
+   cpuLatch(). Called from the main loop. */
+static uint8_t cpuLoad(uint8_t item)
+{
+    uint8_t i, load, isrLoad = 0;
+    uint32_t idle, us[CPU_LOAD_ISRS];
+
+    disableInterrupts();
+    idle = (item == CPU_LOAD_PEAK) ? ((cpuPeakIdleRun < cpuPeakIdleLast) ? cpuPeakIdleRun : cpuPeakIdleLast) : cpuLastIdleUs;
+    for (i = 0; i < CPU_LOAD_ISRS; i++)
+        us[i] = cpuLastIsrUs[i];
+    enableInterrupts();
+
+    load = 100 - CPU_LOAD_PERCENT(idle);
+    if (item == CPU_LOAD_NOW || item == CPU_LOAD_PEAK)
+        return load;
+
+    if (item < CPU_LOAD_MAIN)
+        return CPU_LOAD_PERCENT(us[item - CPU_LOAD_TIM2]);
+
+    for (i = 0; i < CPU_LOAD_ISRS; i++)
+        isrLoad += CPU_LOAD_PERCENT(us[i]);
+    return (load > isrLoad) ? load - isrLoad : 0;
+}
+
+/* Idle hook, called by anything that is just waiting for time to pass or a
+   switch to be pressed. Sleeps until the next interrupt (at most a
+   millisecond away) and counts the time asleep, less the time spent in
+   interrupt handlers, as idle. */
+static void cpuIdle(void)
+{
+    uint16_t t0, t1;
+    uint32_t isr0;
+
+    disableInterrupts();
+    t0 = TIM2_GetCounter();
+    isr0 = cpuIsrTotal;
+
+    /* wfi re-enables interrupts so nothing is missed in between */
+    wfi();
+
+    disableInterrupts();
+    t1 = TIM2_GetCounter();
+    if (t1 < t0)
+        t1 += TIM2_PERIOD + 1;
+    t1 -= t0;
+    isr0 = cpuIsrTotal - isr0;
+    if (t1 > isr0)
+        cpuIdleUs += t1 - isr0;
+    enableInterrupts();
+}
+#endif /* CPU_LOAD */
+
+#ifdef CC_RAMP
+/* Advance the running ramps by a step, called from the TIM2 interrupt every
+   CC_RAMP_STEP_MS. New values are queued for the main loop to send if the
+   channel's budget allows, otherwise the step is skipped and the ramp
+   catches up next time. */
+static void ccRampTick(void)
+{
+    uint8_t i, v;
+    ccRamp_TypeDef *r;
+
+    for (i = 0; i < 16; i++)
+        {
+            ccRampTokens[i] += (CC_RAMP_BUDGET * CC_RAMP_STEP_MS) / 1000;
+            if (ccRampTokens[i] > CC_RAMP_BURST)
+                ccRampTokens[i] = CC_RAMP_BURST;
+        }
+
+    for (i = 0; i < CC_RAMP_SLOTS; i++)
+        {
+            r = &ccRamps[i];
+            if (! r->active)
+                continue;
+
+            if (r->steps)
+                {
+                    r->steps--;
+                    r->acc += r->inc;
+                }
+            v = (r->steps) ? (uint8_t)((r->acc + 0x80) >> 8) : r->target;
+
+            if (v != r->value)
+                {
+                    if (r->pending)
+                        {
+                            /* Not sent yet, just send the newer value instead */
+                            r->value = v;
+                        }
+                    else if (ccRampTokens[r->channel] >= CC_RAMP_MSG_LEN)
+                        {
+                            ccRampTokens[r->channel] -= CC_RAMP_MSG_LEN;
+                            r->value = v;
+                            r->pending = 1;
+                        }
+                }
+
+            if (r->steps == 0 && r->value == r->target)
+                r->active = 0;
+        }
+}
+#endif /* CC_RAMP */
+
+#ifdef PRESS_COALESCE
+/* Debounce the UP and DOWN switches and count presses, called from the
+   TIM2 interrupt while presses are being coalesced. A counted switch is marked as
+   actioned so scanFS() doesn't count it again. */
+static void coalesceTick(void)
+{
+    uint8_t i, down;
+
+    for (i = UP; i <= DOWN; i++)
+        {
+            down = ((GPIO_ReadInputData(FS_PORT) & fsArr[i].pin) == 0x00);
+            if (down == coalesceDown[i])
+                {
+                    coalesceCount[i] = 0;
+                    continue;
+                }
+
+            if (++coalesceCount[i] > DEBOUNCE_THRESHOLD_MS)
+                {
+                    coalesceDown[i] = down;
+                    coalesceCount[i] = 0;
+                    if (down)
+                        {
+                            if (i == UP && coalesceDelta < COALESCE_MAX)
+                                coalesceDelta++;
+                            else if (i == DOWN && coalesceDelta > -COALESCE_MAX)
+                                coalesceDelta--;
+                            fsArr[i].state = FS_SENT;
+                            fsArr[i].timeDown = now;
+                            fsArr[i].firstDown = now;
+                        }
+                }
+        }
+}
+#endif /* PRESS_COALESCE */
+
 /* TIM2 update interrupt handler.
    Interrupt fires when TIM2 hits its 'period' value and is updated. This is
    currently every millisecond. The handler does a number of simple tasks:
@@ -125,9 +485,16 @@ static __IO uint8_t displayIntensity = MAX_DISPLAY_INTENSITY;
      1 - Increments 'now'. This is a uint32_t and will just roll over.
      2 - Decrements msTicks which is used by DelayMs().
      3 - Sets values used when flashing the display
+     4 - Samples the ambient light level if AUTO_BRIGHTNESS is set
+     5 - Updates the CPU load figures once a second if CPU_LOAD is set
+     6 - Steps any CC ramps if CC_RAMP is set
+     7 - Counts footswitch presses while a PC is sent if PRESS_COALESCE is set
+     8 - Counts down the thru stall timeout if MIDI_THRU is set
 */
 INTERRUPT_HANDLER(TIM2_UPD_OVF_BRK_IRQHandler, 13)
 {
+    CPU_ISR_ENTER();
+
     disableInterrupts();
     
     TIM2_ClearITPendingBit(TIM2_IT_UPDATE);
@@ -140,6 +507,63 @@ INTERRUPT_HANDLER(TIM2_UPD_OVF_BRK_IRQHandler, 13)
             msTicks--;
         }
 
+#ifdef MIDI_THRU
+    if (thruStallTicks != 0)
+        {
+            thruStallTicks--;
+        }
+#endif /* MIDI_THRU */
+
+#ifdef CPU_LOAD
+    if (--cpuTicks == 0)
+        {
+            cpuTicks = 1000;
+            cpuLatch();
+        }
+#endif /* CPU_LOAD */
+
+#ifdef PRESS_COALESCE
+    if (coalesceArmed)
+        {
+            coalesceTick();
+        }
+#endif /* PRESS_COALESCE */
+
+#ifdef CC_RAMP
+    if (--ccRampTicks == 0)
+        {
+            ccRampTicks = CC_RAMP_STEP_MS;
+            ccRampTick();
+        }
+#endif /* CC_RAMP */
+
+#ifdef AUTO_BRIGHTNESS
+    if (--ambientTicks == 0)
+        {
+            /* Pick up the conversion started last time round, filter it and
+               move at most one brightness step. The display itself is only
+               updated from the main loop when the step changes. */
+            ambientTicks = AMBIENT_SAMPLE_MS;
+            if (ADC1_GetFlagStatus(ADC1_FLAG_EOC) == SET)
+                {
+                    ambientAcc += ADC1_GetConversionValue() - (ambientAcc >> AMBIENT_FILTER_SHIFT);
+                    ADC1_ClearFlag(ADC1_FLAG_EOC);
+
+                    if (ambientStep < (AMBIENT_STEPS - 1) &&
+                        (ambientAcc >> AMBIENT_FILTER_SHIFT) > ambientThreshold[ambientStep] + AMBIENT_HYSTERESIS)
+                        {
+                            ambientStep++;
+                        }
+                    else if (ambientStep > 0 &&
+                             (ambientAcc >> AMBIENT_FILTER_SHIFT) + AMBIENT_HYSTERESIS < ambientThreshold[ambientStep - 1])
+                        {
+                            ambientStep--;
+                        }
+                }
+            ADC1_StartConversion();
+        }
+#endif /* AUTO_BRIGHTNESS */
+
     if (doFlash)
         /* Flash the display in config mode or mode 2.
            If the external LED is used, it also flashes to
@@ -151,16 +575,16 @@ INTERRUPT_HANDLER(TIM2_UPD_OVF_BRK_IRQHandler, 13)
             switch (flashTicks)
                 {
                 case 0:
-                    if (displayIntensity == MIN_DISPLAY_INTENSITY)
+                    if (displayIntensity != DISPLAY_INTENSITY_HI)
                         {
-                            displayIntensity = MAX_DISPLAY_INTENSITY;
+                            displayIntensity = DISPLAY_INTENSITY_HI;
 #ifdef USE_EXTERNAL_LED
                             EXTERNAL_LED_OFF(LED_GPIO_PORT, (GPIO_Pin_TypeDef)LED_GPIO_PIN);
 #endif /* USE_EXTERNAL_LED */
                         }
                     else
                         {
-                            displayIntensity = MIN_DISPLAY_INTENSITY;
+                            displayIntensity = DISPLAY_INTENSITY_LO;
 #ifdef USE_EXTERNAL_LED
                             EXTERNAL_LED_ON(LED_GPIO_PORT, (GPIO_Pin_TypeDef)LED_GPIO_PIN);
 #endif /* USE_EXTERNAL_LED */
@@ -189,6 +613,7 @@ INTERRUPT_HANDLER(TIM2_UPD_OVF_BRK_IRQHandler, 13)
         }
 #endif /* USE_EXTERNAL_LED */
     
+    CPU_ISR_EXIT(CPU_LOAD_TIM2);
     enableInterrupts();
 }
 
@@ -205,9 +630,9 @@ static void flashDisplay(uint8_t action)
             doFlash = 0;
             // displayIntensity = MAX_DISPLAY_INTENSITY;
 #if defined MAX7219SPI
-            max7219_DisplayIntensity(MAX_DISPLAY_INTENSITY);
+            max7219_DisplayIntensity(DISPLAY_INTENSITY_HI);
 #elif defined SSD1306I2C
-            ssd1306_DisplayIntensity(MAX_DISPLAY_INTENSITY);
+            ssd1306_DisplayIntensity(DISPLAY_INTENSITY_HI);
 #endif /* defined MAX7219SPI */
             
         default:
@@ -221,9 +646,363 @@ void delayMs(uint16_t ms)
     /* Reload us value */
     msTicks = ms;
     /* Wait until msTick reach zero */
-    while (msTicks);
+    while (msTicks)
+        CPU_IDLE();
 }
 
+#ifdef LATENCY_PROBE
+/* Microsecond timestamp from 'now' and the TIM2 counter. Must be called with
+   interrupts disabled or from an interrupt handler so 'now' can't change,
+   the counter may have wrapped with the update interrupt still pending though. */
+static uint32_t timestampUs(void)
+{
+    uint32_t ms = now;
+    uint16_t us = TIM2_GetCounter();
+
+    if (TIM2_GetITStatus(TIM2_IT_UPDATE) == SET && us < (TIM2_PERIOD / 2))
+        ms++;
+
+    return (ms * 1000) + us;
+}
+
+/* Note the latency of the first reply from a device to the current probe */
+static void probeReply(uint8_t device, uint32_t t)
+{
+#ifdef LATENCY_PROBE_IDREQ
+    uint8_t i;
+
+    /* 'device' is a 7 bit device ID, find or give it a device number */
+    for (i = 0; i < probeIds && probeId[i] != device; i++);
+    if (i == probeIds)
+        {
+            if (probeIds == LATENCY_DEVICES)
+                /* No room, ignore it */
+                return;
+            probeId[probeIds++] = device;
+        }
+    device = i;
+#endif /* LATENCY_PROBE_IDREQ */
+
+    if (probeSeen & (1 << device))
+        return;
+
+    probeSeen |= (1 << device);
+    t -= probeSent;
+    probeLatency[device] = (t > 0xFFFF) ? 0xFFFF : (uint16_t)t;
+}
+#endif /* LATENCY_PROBE */
+
+#ifdef MIDI_THRU
+/* Number of data bytes following a status byte, sysex is handled separately */
+static uint8_t midiDataLen(uint8_t status)
+{
+    switch (status & 0xF0)
+        {
+        case 0xC0:
+        case 0xD0:
+            return 1;
+
+        case 0xF0:
+            if (status == 0xF1 || status == 0xF3)
+                return 1;
+            if (status == 0xF2)
+                return 2;
+            return 0;
+
+        default:
+            return 2;
+        }
+}
+
+/* Pass a byte on to MIDI out. Called from the receive interrupt. The byte
+   goes straight into the UART data register (cut-through) unless a local
+   message is being sent, the UART is busy or earlier bytes are waiting. */
+static void thruPut(uint8_t b)
+{
+    if (thruMuted)
+        return;
+
+    if (! thruHeld && thruHead == thruTail && UART1_GetFlagStatus(UART1_FLAG_TXE) == SET)
+        {
+            UART1_SendData8(b);
+            return;
+        }
+
+    if (((thruHead + 1) & (THRU_BUFFER_SIZE - 1)) == thruTail)
+        /* Full, drop it */
+        return;
+
+    thruBuf[thruHead] = b;
+    thruHead = (thruHead + 1) & (THRU_BUFFER_SIZE - 1);
+    UART1_ITConfig(UART1_IT_TXE, ENABLE);
+}
+
+/* Note the incoming stream is at a message boundary. If a local message is
+   waiting, hold everything received from here on until it has been sent. */
+static void thruBoundary(void)
+{
+    if (thruMuted != thruMute)
+        {
+            thruMuted = thruMute;
+            thruStatusLost = 1;
+        }
+
+    if (thruHold && ! thruHeld)
+        {
+            thruMark = thruHead;
+            thruHeld = 1;
+            thruStatusLost = 1;
+        }
+}
+
+/* UART1 transmit interrupt handler.
+   Fires when the UART can take another byte and there are thru bytes
+   buffered. When a local message is being merged only the bytes received
+   before it are sent, the rest wait until midiTxEnd(). */
+INTERRUPT_HANDLER(UART1_TX_IRQHandler, 17)
+{
+    CPU_ISR_ENTER();
+
+    if (thruTail != (thruHeld ? thruMark : thruHead))
+        {
+            UART1_SendData8(thruBuf[thruTail]);
+            thruTail = (thruTail + 1) & (THRU_BUFFER_SIZE - 1);
+        }
+    else
+        {
+            UART1_ITConfig(UART1_IT_TXE, DISABLE);
+        }
+
+    CPU_ISR_EXIT(CPU_LOAD_UART_TX);
+}
+#endif /* MIDI_THRU */
+
+#ifdef HAS_FSTORE_LOADER
+/* Collect a flash store block sent by sysex, called from the receive
+   interrupt for each byte apart from real time messages */
+static void fstoreRx(uint8_t b)
+{
+    uint8_t k;
+
+    if (b == MIDI_SYSEX)
+        {
+            fstoreRxPos = 1;
+            return;
+        }
+    if (fstoreRxPos == 0)
+        return;
+
+    if (b & 0x80)
+        {
+            /* End of the message, complete if all the data arrived */
+            if (b == MIDI_EOX && fstoreRxPos == FSTORE_SYSEX_HDR_LEN + (2 * FSTORE_BLOCK_SIZE))
+                fstoreRxReady = 1;
+            fstoreRxPos = 0;
+            return;
+        }
+
+    switch (fstoreRxPos)
+        {
+        case 1:
+            if (b != FSTORE_SYSEX_ID || fstoreRxReady)
+                fstoreRxPos = 0;
+            break;
+
+        case 2:
+            if (b != FSTORE_SYSEX_ID1)
+                fstoreRxPos = 0;
+            break;
+
+        case 3:
+            if (b != FSTORE_SYSEX_ID2)
+                fstoreRxPos = 0;
+            break;
+
+        case 4:
+            fstoreRxBlock = b;
+            break;
+
+        default:
+            k = fstoreRxPos - FSTORE_SYSEX_HDR_LEN;
+            if (k >= (2 * FSTORE_BLOCK_SIZE))
+                {
+                    /* Too long, not ours */
+                    fstoreRxPos = 0;
+                    return;
+                }
+            if (k & 1)
+                fstoreRxBuf[k >> 1] |= b & 0x0F;
+            else
+                fstoreRxBuf[k >> 1] = b << 4;
+        }
+
+    if (fstoreRxPos)
+        fstoreRxPos++;
+}
+
+/* Program a block received by sysex, called from the main loop. The block
+   number and result are shown for FSTORE_SHOW_MS so a load can be checked.
+   Blocks wait while the display is flashing in mode 2 or config or is
+   scrolling through patches. */
+static void fstoreService(void)
+{
+    uint8_t result;
+    uint8_t busy = doFlash;
+
+#ifdef HOLD_TO_SCROLL
+    busy |= scrolling;
+#endif /* HOLD_TO_SCROLL */
+
+    if (fstoreShown && ! busy && (now - fstoreShowTime) > FSTORE_SHOW_MS)
+        displayPatch(midiPatchNo);
+
+    if (! fstoreRxReady || busy)
+        return;
+
+    result = fstore_WriteBlock(fstoreRxBlock, fstoreRxBuf);
+    fstoreRxReady = 0;
+
+    displayDiag((fstoreRxBlock < 10) ? fstoreRxBlock : 9, result);
+    fstoreShown = 1;
+    fstoreShowTime = now;
+}
+#endif /* HAS_FSTORE_LOADER */
+
+#ifdef HAS_MIDI_IN
+/* UART1 receive interrupt handler.
+   Fires for each byte received on MIDI in. When a latency probe is waiting
+   for replies the byte is timestamped and checked for a PC echo or
+   an identity reply; PC echoes identify the device by their channel,
+   identity replies by their device ID.
+
+   With MIDI_THRU each byte is also forwarded to MIDI out as it arrives
+   rather than once the whole message is in, so thru adds about one byte
+   time (320us) of delay. */
+INTERRUPT_HANDLER(UART1_RX_IRQHandler, 18)
+{
+    uint8_t b;
+    CPU_ISR_ENTER();
+
+    /* Reading the data register clears the receive and overrun flags */
+    b = UART1_ReceiveData8();
+
+#ifdef HAS_FSTORE_LOADER
+    if (b < MIDI_REALTIME)
+        fstoreRx(b);
+#endif /* HAS_FSTORE_LOADER */
+
+#ifdef MIDI_THRU
+    thruStallTicks = THRU_STALL_MS + 1;
+    if (b >= MIDI_REALTIME)
+        {
+            /* Real time messages may go anywhere, even mid-message */
+            thruPut(b);
+        }
+    else if (b & 0x80)
+        {
+            /* Status byte, starts a new message or ends a sysex */
+            if (b != MIDI_EOX)
+                thruBoundary();
+            thruInSysex = (b == MIDI_SYSEX);
+            thruRemaining = (b == MIDI_SYSEX || b == MIDI_EOX) ? 0 : midiDataLen(b);
+            if (b < MIDI_SYSEX)
+                thruRunning = b;
+            else if (b != MIDI_EOX)
+                thruRunning = 0;
+            thruStatusLost = 0;
+            thruPut(b);
+        }
+    else
+        {
+            if (! thruInSysex && thruRemaining == 0)
+                {
+                    /* Running status, a new message without a status byte */
+                    thruBoundary();
+                    thruRemaining = midiDataLen(thruRunning);
+                    if (thruStatusLost && thruRunning)
+                        {
+                            thruPut(thruRunning);
+                            thruStatusLost = 0;
+                        }
+                }
+            thruPut(b);
+            if (thruRemaining)
+                thruRemaining--;
+        }
+
+    if (! thruInSysex && thruRemaining == 0)
+        thruBoundary();
+#endif /* MIDI_THRU */
+
+#if defined LATENCY_PROBE && defined LATENCY_PROBE_IDREQ
+    if (probeWaiting && b < MIDI_REALTIME)
+        {
+            if (b == MIDI_SYSEX)
+                {
+                    /* Latency is to the start of the reply */
+                    probeRxTime = timestampUs();
+                    probeRxState = 1;
+                }
+            else if (b & 0x80)
+                {
+                    probeRxState = 0;
+                }
+            else
+                {
+                    /* Expect F0 7E <id> 06 02 ... */
+                    switch (probeRxState)
+                        {
+                        case 1:
+                            probeRxState = (b == MIDI_UNIVERSAL_NRT) ? 2 : 0;
+                            break;
+
+                        case 2:
+                            probeRxId = b;
+                            probeRxState = 3;
+                            break;
+
+                        case 3:
+                            probeRxState = (b == MIDI_GENERAL_INFO) ? 4 : 0;
+                            break;
+
+                        case 4:
+                            if (b == MIDI_IDENTITY_REPLY)
+                                probeReply(probeRxId, probeRxTime);
+                            probeRxState = 0;
+                            break;
+                        }
+                }
+        }
+#elif defined LATENCY_PROBE
+    if (b < MIDI_REALTIME)
+        {
+            /* A device may echo every PC after the first with running
+               status, as just the program number, so follow the running
+               status even between bursts */
+            if (b & 0x80)
+                {
+                    probeRxRunning = (b < MIDI_SYSEX) ? b : 0;
+                    probeRxPcData = ((b & 0xF0) == MIDI_PC);
+                    if (probeWaiting && probeRxPcData)
+                        probeReply(b & 0x0F, timestampUs());
+                }
+            else if (probeRxPcData)
+                {
+                    /* The program number of the PC just counted */
+                    probeRxPcData = 0;
+                }
+            else if (probeWaiting && (probeRxRunning & 0xF0) == MIDI_PC)
+                {
+                    probeReply(probeRxRunning & 0x0F, timestampUs());
+                }
+        }
+#endif /* defined LATENCY_PROBE && defined LATENCY_PROBE_IDREQ */
+    (void)b;
+
+    CPU_ISR_EXIT(CPU_LOAD_UART_RX);
+}
+#endif /* HAS_MIDI_IN */
+
 /* Use High Speed Internal clock at 16MHz */
 static void initClk(void)
 {
@@ -246,11 +1025,16 @@ static void initClk(void)
     /* Enable the preipherial clocks used */
     CLK_PeripheralClockConfig(CLK_PERIPHERAL_TIMER2, ENABLE);
     CLK_PeripheralClockConfig(CLK_PERIPHERAL_UART1,  ENABLE);
+#ifdef AUTO_BRIGHTNESS
+    CLK_PeripheralClockConfig(CLK_PERIPHERAL_ADC,    ENABLE);
+#endif /* AUTO_BRIGHTNESS */
 
     /* Disable all other clocks for now */
     CLK_PeripheralClockConfig(CLK_PERIPHERAL_SPI,    DISABLE);
     CLK_PeripheralClockConfig(CLK_PERIPHERAL_I2C,    DISABLE);
+#ifndef AUTO_BRIGHTNESS
     CLK_PeripheralClockConfig(CLK_PERIPHERAL_ADC,    DISABLE);
+#endif /* !AUTO_BRIGHTNESS */
     CLK_PeripheralClockConfig(CLK_PERIPHERAL_AWU,    DISABLE);
     CLK_PeripheralClockConfig(CLK_PERIPHERAL_TIMER1, DISABLE);
     CLK_PeripheralClockConfig(CLK_PERIPHERAL_TIMER4, DISABLE);
@@ -263,7 +1047,7 @@ static void initTim2(void)
        Clock runs at 16MHz so prescale of 16 gives 1uS TICK
        and 1000 period gives 1mS timer interrupt */
     TIM2_DeInit();
-    TIM2_TimeBaseInit(TIM2_PRESCALER_16, 1000);
+    TIM2_TimeBaseInit(TIM2_PRESCALER_16, TIM2_PERIOD);
 
     /* TIM2 counter enable */
     TIM2_Cmd(ENABLE);
@@ -285,6 +1069,11 @@ static void initGpio(void)
     /* Set UART_TX_PIN as Output open-drain high-impedance level (UART1_Tx) */
     GPIO_Init(UART_TX_PORT, (GPIO_Pin_TypeDef)UART_TX_PIN, GPIO_MODE_OUT_OD_HIZ_FAST);
 
+#ifdef HAS_MIDI_IN
+    /* UART_RX_PIN is an input with pull-up, driven by the MIDI in optocoupler */
+    GPIO_Init(UART_RX_PORT, (GPIO_Pin_TypeDef)UART_RX_PIN, GPIO_MODE_IN_PU_NO_IT);
+#endif /* HAS_MIDI_IN */
+
     /* Initialise all switch GPIOs as inputs with pull-ups enabled */
     for (i = 0; i < MAXFS; i++)
         {
@@ -301,34 +1090,82 @@ static void initUart(void)
         - Word Length = 8 Bits
         - One Stop Bit
         - No parity
-        - Receive disabled
+        - Receive disabled unless MIDI in is used
         - UART1 Clock disabled
   */
+#ifdef HAS_MIDI_IN
+  UART1_Init((uint32_t)31250, UART1_WORDLENGTH_8D, UART1_STOPBITS_1, UART1_PARITY_NO,
+              UART1_SYNCMODE_CLOCK_DISABLE, UART1_MODE_TXRX_ENABLE);
+  UART1_ITConfig(UART1_IT_RXNE_OR, ENABLE);
+#else
   UART1_Init((uint32_t)31250, UART1_WORDLENGTH_8D, UART1_STOPBITS_1, UART1_PARITY_NO,
               UART1_SYNCMODE_CLOCK_DISABLE, UART1_MODE_TX_ENABLE);
+#endif /* HAS_MIDI_IN */
 
   UART1_Cmd(ENABLE);
 }
 
+#ifdef AUTO_BRIGHTNESS
+/* Setup the ADC to read the LDR. A single conversion is done here to seed
+   the filter and pick the starting brightness step, after that the TIM2
+   interrupt starts a conversion every AMBIENT_SAMPLE_MS and collects the
+   result next time round so neither has to wait for the ADC. */
+static void initAdc(void)
+{
+    uint16_t level;
+
+    GPIO_Init(AMBIENT_GPIO_PORT, (GPIO_Pin_TypeDef)AMBIENT_GPIO_PIN, GPIO_MODE_IN_FL_NO_IT);
+
+    ADC1_DeInit();
+    ADC1_Init(ADC1_CONVERSIONMODE_SINGLE, AMBIENT_ADC_CHANNEL, ADC1_PRESSEL_FCPU_D8,
+              ADC1_EXTTRIG_TIM, DISABLE, ADC1_ALIGN_RIGHT, AMBIENT_ADC_SCHMITT, DISABLE);
+    ADC1_Cmd(ENABLE);
+
+    ADC1_StartConversion();
+    while (ADC1_GetFlagStatus(ADC1_FLAG_EOC) == RESET);
+    level = ADC1_GetConversionValue();
+    ambientAcc = level << AMBIENT_FILTER_SHIFT;
+    ADC1_ClearFlag(ADC1_FLAG_EOC);
+
+    /* Start at the right step rather than stepping up from the darkest
+       one after power-up, no hysteresis as there is no previous step */
+    while (ambientStep < (AMBIENT_STEPS - 1) && level > ambientThreshold[ambientStep])
+        {
+            ambientStep++;
+        }
+    ADC1_StartConversion();
+}
+#endif /* AUTO_BRIGHTNESS */
+
 /* Display the patch number */
 static void displayPatch(uint16_t patchNo)
 {
-    register int8_t i;
+#ifdef HAS_FSTORE_LOADER
+    fstoreShown = 0;
+#endif /* HAS_FSTORE_LOADER */
 
     if (! showZeroBased)
         patchNo++;
-    
+
+    displayNumber(patchNo);
+}
+
+/* Display a number, right aligned */
+static void displayNumber(uint16_t number)
+{
+    register int8_t i;
+
 #if defined MAX7219SPI
     max7219_ClearDisplay();
     
     for (i = 1; i <= MAX7219_NUMDIGITS; i++)
         {
-            if (patchNo > 0)
+            if (number > 0)
                 {
-                    max7219_DisplayChar(i, patchNo % 10);
-                    patchNo /= 10;
+                    max7219_DisplayChar(i, number % 10);
+                    number /= 10;
                 }
-            else if (i == 1)  // special case for showZeroBased mode
+            else if (i == 1)  // special case for 0, eg showZeroBased mode
                 {
                     max7219_DisplayChar(i, 0);
                 }
@@ -340,12 +1177,12 @@ static void displayPatch(uint16_t patchNo)
 #elif defined SSD1306I2C
     for (i = 2; i >= 0; i--)
         {
-            if (patchNo > 0)
+            if (number > 0)
                 {
-                    ssd1306_DisplayChar(i, patchNo % 10);
-                    patchNo /= 10;
+                    ssd1306_DisplayChar(i, number % 10);
+                    number /= 10;
                 }
-            else if (i == 2)  // special case for showZeroBased mode
+            else if (i == 2)  // special case for 0, eg showZeroBased mode
                 {
                     ssd1306_DisplayChar(i, 0);
                 }
@@ -357,7 +1194,207 @@ static void displayPatch(uint16_t patchNo)
 #endif /* defined MAX7219SPI */
 }
 
-/* Construct and send the MIDI PC message */
+#if defined HAS_DIAGNOSTICS || defined HAS_FSTORE_LOADER
+/* Display a diagnostic value, a single digit index followed by a 2 digit
+   value (capped at 99) */
+static void displayDiag(uint8_t idx, uint8_t val)
+{
+    if (val > 99)
+        val = 99;
+
+#if defined MAX7219SPI
+    max7219_ClearDisplay();
+    max7219_DisplayChar(3, idx);
+    max7219_DisplayChar(2, val / 10);
+    max7219_DisplayChar(1, val % 10);
+#elif defined SSD1306I2C
+    ssd1306_DisplayChar(0, idx);
+    ssd1306_DisplayChar(1, val / 10);
+    ssd1306_DisplayChar(2, val % 10);
+#endif /* defined MAX7219SPI */
+}
+#endif /* defined HAS_DIAGNOSTICS || defined HAS_FSTORE_LOADER */
+
+#ifdef MIDI_THRU
+/* Start sending a local message. Waits until the incoming thru stream is
+   between messages and everything received before then has gone out, the
+   thru stream is held in thruBuf[] until midiTxEnd(). */
+static void midiTxBegin(void)
+{
+    thruHold = 1;
+
+    disableInterrupts();
+    if (! thruInSysex && thruRemaining == 0)
+        thruBoundary();
+    enableInterrupts();
+
+    while (! thruHeld)
+        {
+            /* A message cut off part way through would block us forever */
+            if (thruStallTicks == 0)
+                {
+                    disableInterrupts();
+                    thruInSysex = 0;
+                    thruRemaining = 0;
+                    thruBoundary();
+                    enableInterrupts();
+                }
+        }
+    while (thruTail != thruMark);
+}
+
+/* Done sending a local message, let the thru stream flow again */
+static void midiTxEnd(void)
+{
+    disableInterrupts();
+    thruHold = 0;
+    thruHeld = 0;
+    if (thruHead != thruTail)
+        UART1_ITConfig(UART1_IT_TXE, ENABLE);
+    enableInterrupts();
+}
+#endif /* MIDI_THRU */
+
+/* Send a byte as soon as the UART can take it. With MIDI_THRU this must be
+   between midiTxBegin() and midiTxEnd(). */
+static void midiTxByte(uint8_t b)
+{
+    while (UART1_GetFlagStatus(UART1_FLAG_TXE) == RESET);
+    UART1_SendData8(b);
+}
+
+#ifdef CC_RAMP
+/* Start ramping a CC towards 'target' over 'timeMs'. A ramp already running
+   on the same CC is taken over from where it has got to. If every slot is
+   busy with another CC the target is sent straight away instead, rather
+   than cutting short a ramp which is already running. */
+static void ccRampStart(uint8_t channel, uint8_t cc, uint8_t target, uint16_t timeMs)
+{
+    uint8_t i;
+    ccRamp_TypeDef *r = 0;
+
+    for (i = 0; i < CC_RAMP_SLOTS; i++)
+        {
+            if (ccRamps[i].known && ccRamps[i].channel == channel && ccRamps[i].cc == cc)
+                {
+                    r = &ccRamps[i];
+                    break;
+                }
+            /* A finished ramp may still have its last value to send */
+            if (! ccRamps[i].active && ! ccRamps[i].pending)
+                r = &ccRamps[i];
+        }
+
+    if (r == 0)
+        {
+            midiTxBegin();
+            midiTxByte(MIDI_CC | channel);
+            midiTxByte(cc);
+            midiTxByte(target);
+            midiTxEnd();
+            return;
+        }
+
+    disableInterrupts();
+    if (! r->known || r->channel != channel || r->cc != cc)
+        {
+            /* Current value unknown so go straight to the target */
+            r->channel = channel;
+            r->cc = cc;
+            r->value = ~target;
+            r->known = 1;
+            r->pending = 0;
+            timeMs = 0;
+        }
+    r->target = target;
+    r->steps = timeMs / CC_RAMP_STEP_MS;
+    r->acc = (int16_t)r->value * 256;
+    r->inc = (r->steps) ? (((int16_t)target - r->value) * 256) / (int16_t)r->steps : 0;
+    r->active = 1;
+    enableInterrupts();
+}
+
+/* Start any ramps the scene table has for this patch */
+static void ccRampScene(uint16_t patch)
+{
+    uint8_t i;
+#ifdef CC_RAMP_SCENES
+    uint8_t n = sizeof(ccRampScenes) / sizeof(ccRampScenes[0]);
+    const ccRampScene_TypeDef *sc = ccRampScenes;
+#else
+    uint8_t n = 0;
+    const ccRampScene_TypeDef *sc = 0;
+#endif /* CC_RAMP_SCENES */
+#ifdef FLASH_STORE
+    const ccRampScene_TypeDef *fsc;
+    uint16_t len;
+
+    /* Scenes in the flash store replace the built in ones, read in place */
+    fsc = (const ccRampScene_TypeDef *)fstore_Table(FSTORE_TABLE_SCENES, &len);
+    if (fsc != NULL)
+        {
+            sc = fsc;
+            n = len / sizeof(ccRampScene_TypeDef);
+        }
+#endif /* FLASH_STORE */
+
+    for (i = 0; i < n; i++, sc++)
+        {
+            if (sc->patch == patch || sc->patch == CC_RAMP_ANY_PATCH)
+                {
+                    ccRampStart((sc->channel == CC_RAMP_THIS_CHANNEL) ? midiChannel : sc->channel & 0x0F,
+                                sc->cc, sc->target, sc->timeMs);
+                }
+        }
+}
+
+/* Output stage for the ramps. Called from the main loop between footswitch
+   scans so a PC never waits behind more than the one CC being sent. */
+static void ccRampService(void)
+{
+    uint8_t i, v;
+
+    for (i = 0; i < CC_RAMP_SLOTS; i++)
+        {
+            if (! ccRamps[i].pending)
+                continue;
+
+            disableInterrupts();
+            v = ccRamps[i].value;
+            ccRamps[i].pending = 0;
+            enableInterrupts();
+
+            midiTxBegin();
+            midiTxByte(MIDI_CC | ccRamps[i].channel);
+            midiTxByte(ccRamps[i].cc);
+            midiTxByte(v);
+            midiTxEnd();
+
+            /* One at a time, go back and check the footswitches */
+            return;
+        }
+}
+#endif /* CC_RAMP */
+
+/* Construct and transmit the MIDI bank and PC messages */
+static void txMidiPC(uint8_t channel, uint16_t patch)
+{
+    midiTxBegin();
+    if (sendMIDIBank || range ) 
+        {
+            /* Send bank as a CC message */
+            midiTxByte(MIDI_CC | channel);
+            midiTxByte(0x00);
+            midiTxByte(patch / 128);
+        }
+    
+    /* Send patch as PC message */
+    midiTxByte(MIDI_PC | channel);
+    midiTxByte(patch % 128);
+    midiTxEnd();
+}
+
+/* Send the MIDI PC message, remember it and display it */
 static void sendMidiPC(uint16_t patch)
 {
 #ifdef USE_EXTERNAL_LED
@@ -367,22 +1404,11 @@ static void sendMidiPC(uint16_t patch)
 #endif /* USE_EXTERNAL_LED */
     
     /* Send MIDI message */
-    if (sendMIDIBank || range ) 
-        {
-            /* Send bank as a CC message */
-            while (UART1_GetFlagStatus(UART1_FLAG_TXE) == RESET);
-            UART1_SendData8(MIDI_CC | midiChannel);
-            while (UART1_GetFlagStatus(UART1_FLAG_TXE) == RESET);
-            UART1_SendData8(0x00);
-            while (UART1_GetFlagStatus(UART1_FLAG_TXE) == RESET);
-            UART1_SendData8(patch / 128);
-        }
-    
-    /* Send patch as PC message */
-    while (UART1_GetFlagStatus(UART1_FLAG_TXE) == RESET);
-    UART1_SendData8(MIDI_PC | midiChannel);
-    while (UART1_GetFlagStatus(UART1_FLAG_TXE) == RESET);
-    UART1_SendData8(patch % 128);
+    txMidiPC(midiChannel, patch);
+
+#ifdef CC_RAMP
+    ccRampScene(patch);
+#endif /* CC_RAMP */
 
 #ifdef RESTORELASTPC
     unlockEeprom();
@@ -437,17 +1463,45 @@ static uint8_t readEepromByte(uint32_t addr)
     return FLASH_ReadByte(addr);
 }
 
-/* Get the MIDI channel, range and display mode from the EEPROM, reconfigure as required
-   and if changed, update the EEPROM */
-static void manageConfig(void)
+/* Load current MIDI channel, range, display mode and, if RESTORELASTPC is set,
+   the last patch sent from EEPROM */
+static void loadConfig(void)
 {
-    uint8_t buf;
-    
-    /* Load current MIDI channel, range and display mode from EEPROM */
     midiChannel = (readEepromByte(FLASH_DATA_START_PHYSICAL_ADDRESS + CHANNELOFFSET) & 0x0F);
     range = readEepromByte(FLASH_DATA_START_PHYSICAL_ADDRESS + RANGEOFFSET) % (MAXRANGE + 1);
     showZeroBased = readEepromByte(FLASH_DATA_START_PHYSICAL_ADDRESS + DISPLAYOFFSET) & 0x01;
-        
+#ifdef RESTORELASTPC
+    midiPatchNo = ((readEepromByte(FLASH_DATA_START_PHYSICAL_ADDRESS + LASTPCMSB) << 8) +
+                   readEepromByte(FLASH_DATA_START_PHYSICAL_ADDRESS + LASTPCLSB));
+#endif /* RESTORELASTPC */
+}
+
+#ifdef BOOT_RESYNC
+/* Resend the restored patch so the downstream devices agree with the
+   display after a power cut. Sent on the configured channel and any
+   others in BOOT_RESYNC_CHANNELS, see lasc.h. */
+static void resyncRig(void)
+{
+    uint8_t ch;
+
+    /* Nothing sensible to send if the EEPROM holds rubbish */
+    if (midiPatchNo > maxPatch[range])
+        return;
+
+    for (ch = 0; ch < 16; ch++)
+        {
+            if (ch == midiChannel || (BOOT_RESYNC_CHANNELS & (1 << ch)))
+                txMidiPC(ch, midiPatchNo);
+        }
+}
+#endif /* BOOT_RESYNC */
+
+/* Reconfigure the MIDI channel, range and display mode loaded by loadConfig() as
+   required and if changed, update the EEPROM */
+static void manageConfig(void)
+{
+    uint8_t buf;
+    
     /* If a FS is held down on power-up, enter config mode otherwise return.
        The initial contents of the EEPROM is expected to be all zeros which will
        result in the device transmitting on channel 1 with a PC range of 0-127
@@ -461,6 +1515,12 @@ static void manageConfig(void)
         {
             configDisplay();
         }
+#ifdef HAS_DIAGNOSTICS
+    else if (buf == MODE)
+        {
+            diagnostics();
+        }
+#endif /* HAS_DIAGNOSTICS */
     else 
         {
             configMIDI();
@@ -565,6 +1625,294 @@ static void configMIDI(void)
         }
 }
 
+#ifdef LATENCY_PROBE
+/* Send a burst of probes and build the latency histogram. Each probe is
+   timed from the end of its last byte so the result is the time the
+   device takes to act on the message and start replying. */
+static void probeBurst(void)
+{
+    uint8_t n, d, bin;
+    uint16_t t;
+
+    for (d = 0; d < LATENCY_DEVICES; d++)
+        for (bin = 0; bin < LATENCY_BINS; bin++)
+            probeHist[d][bin] = 0;
+    probeDevices = 0;
+#ifdef LATENCY_PROBE_IDREQ
+    probeIds = 0;
+#endif /* LATENCY_PROBE_IDREQ */
+#ifdef MIDI_THRU
+    /* Echoes forwarded back to the device that sent them would echo round
+       and round, so thru is off for the burst */
+    thruMute = 1;
+#endif /* MIDI_THRU */
+
+    for (n = 0; n < LATENCY_PROBE_COUNT; n++)
+        {
+            probeSeen = 0;
+#ifdef LATENCY_PROBE_IDREQ
+            probeRxState = 0;
+#endif /* LATENCY_PROBE_IDREQ */
+
+            midiTxBegin();
+#ifdef LATENCY_PROBE_IDREQ
+            midiTxByte(MIDI_SYSEX);
+            midiTxByte(MIDI_UNIVERSAL_NRT);
+            midiTxByte(MIDI_ALL_DEVICES);
+            midiTxByte(MIDI_GENERAL_INFO);
+            midiTxByte(MIDI_IDENTITY_REQUEST);
+            midiTxByte(MIDI_EOX);
+#else
+            midiTxByte(MIDI_PC | midiChannel);
+            midiTxByte(midiPatchNo % 128);
+#endif /* LATENCY_PROBE_IDREQ */
+            while (UART1_GetFlagStatus(UART1_FLAG_TC) == RESET);
+            midiTxEnd();
+
+            disableInterrupts();
+            probeSent = timestampUs();
+            probeWaiting = 1;
+            enableInterrupts();
+
+            delayMs(LATENCY_PROBE_WAIT_MS);
+            probeWaiting = 0;
+
+            for (d = 0; d < LATENCY_DEVICES; d++)
+                {
+                    if ((probeSeen & (1 << d)) == 0)
+                        continue;
+
+                    /* bin 0 is under 2^LATENCY_BIN0_SHIFT us, each bin after doubles */
+                    t = probeLatency[d] >> LATENCY_BIN0_SHIFT;
+                    for (bin = 0; t && bin < (LATENCY_BINS - 1); bin++)
+                        t >>= 1;
+
+                    if (probeHist[d][bin] < 0xFF)
+                        probeHist[d][bin]++;
+                    probeDevices |= (1 << d);
+                }
+        }
+
+#ifdef MIDI_THRU
+    thruMute = 0;
+#endif /* MIDI_THRU */
+}
+
+/* Show a page of the latency results, page 0 shows the device (its MIDI
+   channel, 1 - 16, or its device ID, 0 - 127) and pages 1 - LATENCY_BINS
+   the number of replies in each bin */
+static void probeShow(uint8_t device, uint8_t page)
+{
+    if (page == 0)
+        {
+#ifdef LATENCY_PROBE_IDREQ
+            displayNumber(probeId[device]);
+#else
+            displayNumber(device + 1);
+#endif /* LATENCY_PROBE_IDREQ */
+        }
+    else
+        {
+            displayDiag(page - 1, probeHist[device][page - 1]);
+        }
+}
+
+#endif /* LATENCY_PROBE */
+
+#ifdef HAS_DIAGNOSTICS
+#ifdef CPU_LOAD
+#define DIAG_CPU_PAGES        CPU_LOAD_ITEMS
+#else
+#define DIAG_CPU_PAGES        0
+#endif /* CPU_LOAD */
+
+/* Number of diagnostic pages, the CPU load figures followed by a page per
+   latency histogram bin plus a heading for each device that replied */
+static uint8_t diagPageCount(void)
+{
+    uint8_t n = DIAG_CPU_PAGES;
+#ifdef LATENCY_PROBE
+    uint8_t d;
+
+    for (d = 0; d < LATENCY_DEVICES; d++)
+        if (probeDevices & (1 << d))
+            n += LATENCY_BINS + 1;
+#endif /* LATENCY_PROBE */
+    return n;
+}
+
+/* Show a diagnostic page */
+static void diagShow(uint8_t page)
+{
+#ifdef LATENCY_PROBE
+    uint8_t d;
+#endif /* LATENCY_PROBE */
+
+#ifdef CPU_LOAD
+    if (page < CPU_LOAD_ITEMS)
+        {
+            displayDiag(page, cpuLoad(page));
+            return;
+        }
+    page -= CPU_LOAD_ITEMS;
+#endif /* CPU_LOAD */
+
+#ifdef LATENCY_PROBE
+    for (d = 0; d < LATENCY_DEVICES; d++)
+        {
+            if ((probeDevices & (1 << d)) == 0)
+                continue;
+            if (page <= LATENCY_BINS)
+                {
+                    probeShow(d, page);
+                    return;
+                }
+            page -= LATENCY_BINS + 1;
+        }
+
+    /* Nothing to show yet, just the channel probes will be sent on */
+#if defined MAX7219SPI
+    max7219_ShowMidiChannel(midiChannel, range);
+#elif defined SSD1306I2C
+    ssd1306_ShowMidiChannel(midiChannel, range);
+#endif /* defined MAX7219SPI */
+#endif /* LATENCY_PROBE */
+}
+
+/* Wait for MODE to be released, returns 1 if it was held for 'ms' or more,
+   in which case it returns straight away without waiting for release */
+static uint8_t modeHeld(uint16_t ms)
+{
+    uint32_t start = now;
+
+    while ((GPIO_ReadInputData(FS_PORT) & fsArr[MODE].pin) == 0x00)
+        {
+            if ((now - start) >= ms)
+                return 1;
+            CPU_IDLE();
+        }
+    return 0;
+}
+
+/* Diagnostic mode, entered by holding MODE at power-up or a long press of
+   MODE while running. UP and DOWN step through the pages, MODE sends a
+   burst of latency probes and jumps to the results and a long press of
+   MODE returns. The display is refreshed every DIAG_REFRESH_MS so the CPU
+   load figures stay current. */
+static void diagnostics(void)
+{
+    uint8_t page = 0;
+    uint8_t pages = diagPageCount();
+    uint8_t idle = 0;
+
+    diagShow(page);
+
+    while (1)
+        {
+            switch (scanFS(AUTOREPEAT_OFF, DIAG_REFRESH_MS))
+                {
+                case UP:
+                    idle = 0;
+                    if (++page >= pages)
+                        page = 0;
+                    break;
+
+                case DOWN:
+                    idle = 0;
+                    if (pages)
+                        page = (page == 0) ? pages - 1 : page - 1;
+                    break;
+
+                case MODE:
+                    idle = 0;
+                    if (modeHeld(DIAG_HOLD_MS))
+                        return;
+#ifdef LATENCY_PROBE
+                    probeBurst();
+                    pages = diagPageCount();
+                    page = (pages > DIAG_CPU_PAGES) ? DIAG_CPU_PAGES : 0;
+#endif /* LATENCY_PROBE */
+                    break;
+
+                default:
+                    if (++idle >= DIAG_EXIT_S)
+                        return;
+                }
+            diagShow(page);
+        }
+}
+#endif /* HAS_DIAGNOSTICS */
+
+/* Return the patch 'delta' away from 'patch', wrapping round the range */
+static uint16_t stepPatch(uint16_t patch, int8_t delta)
+{
+    int16_t p = (int16_t)patch + delta;
+    int16_t n = maxPatch[range] + 1;
+
+    while (p < 0)
+        p += n;
+    return p % n;
+}
+
+/* Immediate mode UP/DOWN. Sends the new patch, with PRESS_COALESCE any
+   presses while it is being sent or in the COALESCE_WINDOW_MS after each
+   press only change the display, once they stop the patch reached is sent
+   as one more PC rather than one PC for each. */
+static void patchChange(uint16_t patch)
+{
+#ifdef PRESS_COALESCE
+    uint8_t i;
+    int8_t delta, shown;
+    uint32_t lastPress;
+
+    disableInterrupts();
+    for (i = UP; i <= DOWN; i++)
+        {
+            /* A switch already down, usually the one just pressed, doesn't count */
+            coalesceDown[i] = ((GPIO_ReadInputData(FS_PORT) & fsArr[i].pin) == 0x00);
+            coalesceCount[i] = 0;
+        }
+    coalesceDelta = 0;
+    coalesceArmed = 1;
+    enableInterrupts();
+
+    do
+        {
+            midiPatchNo = patch;
+            sendMidiPC(midiPatchNo);
+
+            /* Wait for the presses to stop, showing where they have got to */
+            shown = 0;
+            lastPress = now;
+            while ((now - lastPress) < COALESCE_WINDOW_MS)
+                {
+                    delta = coalesceDelta;
+                    if (delta != shown)
+                        {
+                            shown = delta;
+                            displayPatch(stepPatch(midiPatchNo, delta));
+                            lastPress = now;
+                        }
+#ifdef CC_RAMP
+                    ccRampService();
+#endif /* CC_RAMP */
+                    CPU_IDLE();
+                }
+
+            disableInterrupts();
+            delta = coalesceDelta;
+            coalesceDelta = 0;
+            enableInterrupts();
+            patch = stepPatch(midiPatchNo, delta);
+        }
+    while (delta);
+    coalesceArmed = 0;
+#else
+    midiPatchNo = patch;
+    sendMidiPC(midiPatchNo);
+#endif /* PRESS_COALESCE */
+}
+
 /* Mode 2 - display flashes and increments/decrements on relevant footswitch press.
    If a switch is held down then the action autorepeats. Pressing the MODE switch
    sends the PC message, stops flashing and reverts to MODE 1. */
@@ -641,6 +1989,18 @@ static uint8_t scanFS(uint8_t autoRepeat, uint16_t timeoutMs)
                     ssd1306_DisplayIntensity(displayIntensity);
 #endif /* defined MAX7219SPI */
                 }
+#ifdef AUTO_BRIGHTNESS
+            else if (shownStep != ambientStep)
+                {
+                    /* Ambient light has changed enough to need a new intensity */
+                    shownStep = ambientStep;
+#if defined MAX7219SPI
+                    max7219_DisplayIntensity(DISPLAY_INTENSITY_HI);
+#elif defined SSD1306I2C
+                    ssd1306_DisplayIntensity(DISPLAY_INTENSITY_HI);
+#endif /* defined MAX7219SPI */
+                }
+#endif /* AUTO_BRIGHTNESS */
             
             for (i = 0; i < MAXFS; i++)
                 {
@@ -677,6 +2037,9 @@ static uint8_t scanFS(uint8_t autoRepeat, uint16_t timeoutMs)
                                             /* Down long enough, do it */
                                             fsArr[i].state = FS_SENT;
                                             fsArr[i].timeDown = now;
+#ifdef HOLD_TO_SCROLL
+                                            fsRepeat = 0;
+#endif /* HOLD_TO_SCROLL */
                                             return i;
                                         }
                                     break;
@@ -697,6 +2060,9 @@ static uint8_t scanFS(uint8_t autoRepeat, uint16_t timeoutMs)
                                         {
                                             /* Down long enough, do it */
                                             fsArr[i].timeDown = now;
+#ifdef HOLD_TO_SCROLL
+                                            fsRepeat = 1;
+#endif /* HOLD_TO_SCROLL */
                                             return i;
                                         }
                                 }
@@ -708,12 +2074,28 @@ static uint8_t scanFS(uint8_t autoRepeat, uint16_t timeoutMs)
                             autoRepeatPeriod = AUTOREPEAT_AFTER_MS;
                         }
                 }
+
+#ifdef CC_RAMP
+            ccRampService();
+#endif /* CC_RAMP */
+
+#ifdef HAS_FSTORE_LOADER
+            fstoreService();
+#endif /* HAS_FSTORE_LOADER */
+
+            /* Nothing to do until the next tick */
+            CPU_IDLE();
         }
 }
 
 
 void main(void)
 {
+    uint8_t key;
+#ifdef HOLD_TO_SCROLL
+    uint16_t scrollPatch = 0;
+#endif /* HOLD_TO_SCROLL */
+
     disableInterrupts();
 
     /* Initialise hardware */
@@ -721,10 +2103,26 @@ void main(void)
     initTim2();
     initGpio();
     initUart();
+#ifdef AUTO_BRIGHTNESS
+    initAdc();
+#endif /* AUTO_BRIGHTNESS */
+#ifdef FLASH_STORE
+    /* Only fails if the block programming code has outgrown its RAM
+       buffer, tables can still be read and a sysex load shows the error
+       for each block */
+    (void)fstore_Init();
+#endif /* FLASH_STORE */
 
     /* Enable interrupts so the timer is available */
     enableInterrupts();
 
+    loadConfig();
+#ifdef BOOT_RESYNC
+    /* Get the rig back in step as soon as the UART is up, long
+       before the display is ready */
+    resyncRig();
+#endif /* BOOT_RESYNC */
+
 #if defined MAX7219SPI
     max7219_Init();
 #elif defined SSD1306I2C
@@ -734,12 +2132,8 @@ void main(void)
     /* Get/set config */
     manageConfig();
 
-    /* On startup, the MIDI program number is 0,
-       display it but don't transmit it */
-#ifdef RESTORELASTPC
-    midiPatchNo = ((readEepromByte(FLASH_DATA_START_PHYSICAL_ADDRESS + LASTPCMSB) << 8) +
-                   readEepromByte(FLASH_DATA_START_PHYSICAL_ADDRESS + LASTPCLSB));
-#endif /* RESTORELASTPC */
+    /* On startup, the MIDI program number is 0 or the restored one,
+       display it but don't transmit it (unless BOOT_RESYNC did already) */
     displayPatch(midiPatchNo);
 
     /* All initialisation is done */
@@ -751,26 +2145,73 @@ void main(void)
     /* Scan switches and send messages */
     while(1)
         {
-            switch(scanFS(AUTOREPEAT_OFF, 0))
+#ifdef HOLD_TO_SCROLL
+            /* Pressing UP or DOWN only shows the next patch, holding it
+               scrolls on through the patches on the display. Whichever
+               patch is shown is sent when the switch is released, so a
+               tap and a hold both send a single PC. */
+            key = scanFS(AUTOREPEAT_ON, scrolling ? HOLD_SCROLL_POLL_MS : 0);
+            if (key == UP || key == DOWN)
+                {
+                    if (! scrolling)
+                        {
+                            scrollPatch = midiPatchNo;
+                            scrolling = 1;
+                        }
+                    scrollPatch = stepPatch(scrollPatch, (key == UP) ? 1 : -1);
+                    displayPatch(scrollPatch);
+                    continue;
+                }
+
+            if (key == MODE && fsRepeat)
+                continue;
+
+            if (scrolling)
+                {
+                    if (key == 0xFF &&
+                        (fsArr[UP].state != FS_UP || fsArr[DOWN].state != FS_UP))
+                        /* Still held */
+                        continue;
+
+                    scrolling = 0;
+                    if (key == 0xFF)
+                        {
+                            /* Released, commit */
+                            patchChange(scrollPatch);
+                            continue;
+                        }
+                    /* MODE, carry on from the patch shown in mode 2 */
+                    midiPatchNo = scrollPatch;
+                }
+#else
+            key = scanFS(AUTOREPEAT_OFF, 0);
+#endif /* HOLD_TO_SCROLL */
+
+            switch(key)
                 {
                 case UP:
                     /* PC up */
-                    ++midiPatchNo;
-                    midiPatchNo %= (maxPatch[range] + 1);
-                    sendMidiPC(midiPatchNo);
+                    patchChange(stepPatch(midiPatchNo, 1));
                     break;
 
                 case DOWN:
                     /* PC down */
-                    --midiPatchNo;
-                    if (midiPatchNo > maxPatch[range])
-                        {
-                            midiPatchNo = maxPatch[range];
-                        }
-                    sendMidiPC(midiPatchNo);
+                    patchChange(stepPatch(midiPatchNo, -1));
                     break;
 
                 case MODE:
+#ifdef HAS_DIAGNOSTICS
+                    /* A long press shows the diagnostic pages instead, a
+                       short one enters mode 2 once MODE is released */
+                    if (modeHeld(DIAG_HOLD_MS))
+                        {
+                            flashDisplay(START_FLASH);
+                            diagnostics();
+                            flashDisplay(STOP_FLASH);
+                            displayPatch(midiPatchNo);
+                            break;
+                        }
+#endif /* HAS_DIAGNOSTICS */
                     /* mode 2 */
                     mode2();
                     break;
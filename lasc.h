@@ -29,6 +29,9 @@
 #ifndef __LASC_H__
 #define __LASC_H__
  
+/* TIM2 counts 1us ticks up to TIM2_PERIOD, the update interrupt is the 1ms tick */
+#define TIM2_PERIOD           1000
+
 /* Length of time a switch needs to be down to activate (in ms) */
 #define DEBOUNCE_THRESHOLD_MS 50
 
@@ -59,6 +62,27 @@
 #define UART_TX_PORT          (GPIOD)
 #define UART_TX_PIN           (GPIO_PIN_5)
 
+/* MIDI in is only needed by some options */
+#if defined LATENCY_PROBE || defined MIDI_THRU
+#define HAS_MIDI_IN
+#endif /* defined LATENCY_PROBE || defined MIDI_THRU */
+
+#ifdef MIDI_THRU
+/* Bytes held while a local message is merged into the thru stream or
+   while the UART is still busy, must be a power of 2 */
+#define THRU_BUFFER_SIZE      32
+
+/* If the incoming stream stops part way through a message for this long,
+   assume it isn't coming back and send the local message anyway, max 254 */
+#define THRU_STALL_MS         5
+#endif /* MIDI_THRU */
+
+#ifdef HAS_MIDI_IN
+/* Port and Pin used for UART receive */
+#define UART_RX_PORT          (GPIOD)
+#define UART_RX_PIN           (GPIO_PIN_6)
+#endif /* HAS_MIDI_IN */
+
 /* GPIO ports and pins connected to footswitches */
 #define FS_PORT               (GPIOC)
 #define UP                    0x00 
@@ -77,6 +101,27 @@
 /* MIDI codes */
 #define MIDI_PC               0xC0  /* 1100 0000 */
 #define MIDI_CC               0xB0  /* 1011 0000 */
+#define MIDI_SYSEX            0xF0
+#define MIDI_EOX              0xF7
+#define MIDI_REALTIME         0xF8  /* 0xF8 - 0xFF are single byte real time messages */
+#define MIDI_UNIVERSAL_NRT    0x7E
+#define MIDI_ALL_DEVICES      0x7F
+#define MIDI_GENERAL_INFO     0x06
+#define MIDI_IDENTITY_REQUEST 0x01
+#define MIDI_IDENTITY_REPLY   0x02
+
+#ifdef BOOT_RESYNC
+#ifndef RESTORELASTPC
+#error "BOOT_RESYNC needs RESTORELASTPC to know which patch to resend!"
+#endif /* !RESTORELASTPC */
+/* At power-up the restored patch is sent on the configured MIDI channel
+   and on any others set in this mask (bit 0 is channel 1), for rigs
+   where several devices follow the same patch number on their own
+   channels. */
+#ifndef BOOT_RESYNC_CHANNELS
+#define BOOT_RESYNC_CHANNELS  0x0000
+#endif /* !BOOT_RESYNC_CHANNELS */
+#endif /* BOOT_RESYNC */
 
 /* EEPROM byte offsets */
 #define CHANNELOFFSET         0
@@ -102,6 +147,128 @@
 #define MAXRANGE_3            799
 #define MAXRANGE_4            998
 
+#ifdef LATENCY_PROBE
+/* Round trip latency probe. Each burst sends LATENCY_PROBE_COUNT probes, either
+   a PC on the current channel or, if LATENCY_PROBE_IDREQ is defined, a universal
+   identity request. Replies are waited for for LATENCY_PROBE_WAIT_MS and sorted
+   by device into LATENCY_BINS bins, bin 0 is under 0.5ms and each bin doubles
+   the range of the one before, bin 7 is 32ms or more. */
+#define LATENCY_PROBE_COUNT   16
+#define LATENCY_PROBE_WAIT_MS 100
+#define LATENCY_BINS          8
+#define LATENCY_BIN0_SHIFT    9
+#define LATENCY_DEVICES       16
+#endif /* LATENCY_PROBE */
+
+#ifdef CPU_LOAD
+/* CPU load figures, each a percentage updated once a second. The peak is
+   the highest load seen in at least the last CPU_LOAD_PEAK_S seconds, the rest
+   break the load down by interrupt handler with the remainder being the
+   main loop. */
+#define CPU_LOAD_NOW          0
+#define CPU_LOAD_PEAK         1
+#define CPU_LOAD_TIM2         2
+#define CPU_LOAD_UART_RX      3
+#define CPU_LOAD_UART_TX      4
+#define CPU_LOAD_MAIN         5
+#define CPU_LOAD_ITEMS        6
+#define CPU_LOAD_ISRS         3
+#define CPU_LOAD_PEAK_S       10
+
+/* A second of TIM2 counts */
+#define CPU_LOAD_SECOND_US    (1000UL * (TIM2_PERIOD + 1))
+#endif /* CPU_LOAD */
+
+#ifdef CC_RAMP
+/* Scene actions - timed CC ramps started when a patch is sent. Each entry
+   in CC_RAMP_SCENES is { patch, channel, CC number, target value, time in ms }
+   and moves the CC from the value last sent to the target over the
+   given time. A patch of CC_RAMP_ANY_PATCH matches every patch, a channel
+   of CC_RAMP_THIS_CHANNEL uses the configured MIDI channel. The first ramp
+   of a CC jumps straight to the target since its current value isn't known
+   and a ramp to the value the CC already has sends nothing.
+
+   There is no table unless CC_RAMP_SCENES is defined here, or the example
+   is turned on with CC_RAMP_EXAMPLE, so scenes can also come only from the
+   flash store. The example moves CC 7 (volume) between two levels: the
+   first patch fades it up to 100 over half a second, the second fades it
+   down to 40 over a second. The first time either is selected the volume
+   is just set. */
+#define CC_RAMP_ANY_PATCH     0xFFFF
+#define CC_RAMP_THIS_CHANNEL  0xFF
+#ifdef CC_RAMP_EXAMPLE
+#define CC_RAMP_SCENES        { { 0, CC_RAMP_THIS_CHANNEL, 7, 100, 500 }, \
+                                { 1, CC_RAMP_THIS_CHANNEL, 7, 40, 1000 } }
+#endif /* CC_RAMP_EXAMPLE */
+
+/* Number of ramps which may run at once and the interval between steps */
+#define CC_RAMP_SLOTS         4
+#define CC_RAMP_STEP_MS       10
+
+/* Ramps share a bandwidth budget per MIDI channel so they can't swamp the
+   link or hold up a PC, a step is skipped if the budget is used up. The
+   budget is CC_RAMP_BUDGET bytes per second, up to CC_RAMP_BURST bytes
+   may be saved up. */
+#define CC_RAMP_BUDGET        300
+#define CC_RAMP_BURST         6
+#define CC_RAMP_MSG_LEN       3
+
+/* A scene action, see CC_RAMP_SCENES */
+typedef struct ccRampScene_struct
+{
+    uint16_t patch;
+    uint8_t channel;
+    uint8_t cc;
+    uint8_t target;
+    uint16_t timeMs;
+}
+ccRampScene_TypeDef;
+
+/* A running ramp. 'acc' is the ramp position in 8.8 fixed point, moving by
+   'inc' each step for 'steps' steps. 'value' is the last value sent or
+   waiting to be sent, 'pending' is set while it is waiting. */
+typedef struct ccRamp_struct
+{
+    uint8_t channel;
+    uint8_t cc;
+    uint8_t target;
+    uint8_t value;
+    uint8_t known;
+    uint8_t active;
+    uint8_t pending;
+    uint16_t steps;
+    int16_t acc;
+    int16_t inc;
+}
+ccRamp_TypeDef;
+#endif /* CC_RAMP */
+
+#if defined FLASH_STORE && defined HAS_MIDI_IN
+/* Blocks of the flash store may be loaded over MIDI with a sysex message:
+   F0 7D 4C 53 <block> <64 data bytes, each sent as 2 nibbles, high first> F7
+   7D is the non-commercial manufacturer ID, 4C 53 is 'LS'. */
+#define HAS_FSTORE_LOADER
+#define FSTORE_SYSEX_ID       0x7D
+#define FSTORE_SYSEX_ID1      0x4C
+#define FSTORE_SYSEX_ID2      0x53
+#define FSTORE_SYSEX_HDR_LEN  5    /* F0 to the block number */
+
+/* After each block the display shows the block number and the result
+   (see flash-store.h, 00 is ok) for this long */
+#define FSTORE_SHOW_MS        1000
+#endif /* defined FLASH_STORE && defined HAS_MIDI_IN */
+
+#if defined LATENCY_PROBE || defined CPU_LOAD
+/* Diagnostic mode, entered by holding MODE at power-up or holding it for
+   DIAG_HOLD_MS while running. The display is refreshed every
+   DIAG_REFRESH_MS and the mode exits on another long press of MODE or
+   after DIAG_EXIT_S seconds without a footswitch press. */
+#define HAS_DIAGNOSTICS
+#define DIAG_HOLD_MS          1500
+#define DIAG_REFRESH_MS       1000
+#define DIAG_EXIT_S           30
+#endif /* defined LATENCY_PROBE || defined CPU_LOAD */
+
 /* Allow footswitches to autorepeat and get faster! */
 #define AUTOREPEAT_OFF        0x00
 #define AUTOREPEAT_ON         0x01
@@ -110,6 +277,19 @@
 #define AUTOREPEAT_AFTER_MS   300
 #define AUTOREPEAT_FAST_MS    60
 
+#ifdef HOLD_TO_SCROLL
+/* How often to check for the switch being released while scrolling */
+#define HOLD_SCROLL_POLL_MS   20
+#endif /* HOLD_TO_SCROLL */
+
+#ifdef PRESS_COALESCE
+/* After a PC is sent, UP and DOWN presses only change the display until
+   none has come for COALESCE_WINDOW_MS, then they are sent as one PC.
+   COALESCE_MAX limits the patch change which can build up. */
+#define COALESCE_WINDOW_MS    300
+#define COALESCE_MAX          100
+#endif /* PRESS_COALESCE */
+
 /* The states the physical switch can be in - 'up' or 'down' plus 'sent' which
    means the switch positiion is unchanged but the message/action it
    activates is done - this is to stop repeating the message/action without
@@ -140,4 +320,48 @@ footSwitch_TypeDef;
 #define MAX_DISPLAY_INTENSITY 0xFF
 #endif /* defined MAX7219SPI */
 
+#ifdef AUTO_BRIGHTNESS
+/* Light dependent resistor on a spare ADC pin. The LDR goes from 3v3 to the
+   pin with a fixed resistor (10K or so) from the pin to ground so the
+   voltage, and the ADC reading, rises with the ambient light level. */
+#define AMBIENT_GPIO_PORT     (GPIOD)
+#define AMBIENT_GPIO_PIN      (GPIO_PIN_3)
+#define AMBIENT_ADC_CHANNEL   ADC1_CHANNEL_4
+#define AMBIENT_ADC_SCHMITT   ADC1_SCHMITTTRIG_CHANNEL4
+
+/* The LDR is sampled every AMBIENT_SAMPLE_MS by the TIM2 interrupt and
+   smoothed by a simple IIR filter, each new sample contributes
+   1/(2^AMBIENT_FILTER_SHIFT) so the display follows slow changes in
+   light but ignores someone walking past. */
+#define AMBIENT_SAMPLE_MS     100
+#define AMBIENT_FILTER_SHIFT  3
+
+/* The filtered 10 bit reading is mapped onto AMBIENT_STEPS brightness
+   steps. AMBIENT_THRESHOLD_n is the reading above which step n+1 is used,
+   AMBIENT_HYSTERESIS stops the display hunting between two steps when
+   the light level sits close to a threshold. */
+#define AMBIENT_STEPS         4
+#define AMBIENT_THRESHOLD_0   64
+#define AMBIENT_THRESHOLD_1   256
+#define AMBIENT_THRESHOLD_2   640
+#define AMBIENT_HYSTERESIS    16
+
+/* Display intensity for each step, darkest first. When flashing, the
+   display alternates between the step's intensity and the 'dim' value. */
+#if defined MAX7219SPI
+#define AMBIENT_INTENSITY     { MAX7219_INTENSITY_3, MAX7219_INTENSITY_9, MAX7219_INTENSITY_19, MAX7219_INTENSITY_31 }
+#define AMBIENT_INTENSITY_DIM { MAX7219_INTENSITY_1, MAX7219_INTENSITY_1, MAX7219_INTENSITY_5,  MAX7219_INTENSITY_11 }
+#elif defined SSD1306I2C
+#define AMBIENT_INTENSITY     { 0x08, 0x30, 0x90, 0xFF }
+#define AMBIENT_INTENSITY_DIM { 0x00, 0x00, 0x10, 0x30 }
+#endif /* defined MAX7219SPI */
+
+/* Current 'on' and 'off' intensities used by the display and flash code */
+#define DISPLAY_INTENSITY_HI  (ambientIntensity[ambientStep])
+#define DISPLAY_INTENSITY_LO  (ambientIntensityDim[ambientStep])
+#else
+#define DISPLAY_INTENSITY_HI  MAX_DISPLAY_INTENSITY
+#define DISPLAY_INTENSITY_LO  MIN_DISPLAY_INTENSITY
+#endif /* AUTO_BRIGHTNESS */
+
 #endif /* __LASC_H__ */